@@ -18,21 +18,167 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
 #include <cstdlib>
+#include <system_error>
+#include <thread>
 #include "jjConfig.h"
 
 using namespace std;
 
-jjConfig::jjConfig(const string &Archivo)
+/* indica si un archivo del directorio de fragmentos debe cargarse: se
+ * ignoran los ocultos y los que dejan los editores y gestores de paquetes */
+static bool es_fragmento(const string &Nombre)
 {
-    this->file = Archivo;
+    static const char *sufijos[] = {
+        "~", ".swp", ".swo", ".bak", ".orig", ".rej", ".tmp",
+        ".dpkg-old", ".dpkg-new", ".dpkg-dist", ".dpkg-tmp",
+        ".rpmnew", ".rpmsave", ".rpmorig", ".ucf-old", ".ucf-new", ".ucf-dist"
+    };
+    if (Nombre.empty() || Nombre[0] == '.' || Nombre[0] == '#')
+        return false;
+    for (size_t i=0; i<sizeof(sufijos)/sizeof(sufijos[0]); ++i){
+        string sufijo(sufijos[i]);
+        if (Nombre.size() > sufijo.size() &&
+                Nombre.compare(Nombre.size() - sufijo.size(), sufijo.size(), sufijo) == 0)
+            return false;
+    }
+    return true;
+}
+
+jjConfig::jjConfig(const string &Archivo) : directorio_incompleto(false)
+{
+    this->archivos.push_back(Archivo);
     cargar_datos();
+    filtro_reconstruir();
+}
+
+jjConfig::jjConfig(const string &Archivo, const string &Directorio) :
+    directorio_incompleto(false)
+{
+    this->archivos.push_back(Archivo);
+    //los fragmentos son los archivos regulares del directorio que no sean
+    //ocultos ni de respaldo, en orden lexicográfico:
+    vector<string> fragmentos;
+    error_code ec;
+    filesystem::directory_iterator dir(Directorio, ec), fin;
+    for (; !ec && dir != fin; dir.increment(ec)){
+        error_code ectipo;
+        if (dir->is_regular_file(ectipo) && es_fragmento(dir->path().filename().string()))
+            fragmentos.push_back(dir->path().string());
+        else if (ectipo)
+            this->directorio_incompleto = true;
+    }
+    //que el directorio no exista no es un error, pero sí que no se haya
+    //podido recorrer entero:
+    if (ec && ec != errc::no_such_file_or_directory)
+        this->directorio_incompleto = true;
+    sort(fragmentos.begin(), fragmentos.end());
+    //descartar los que son el mismo archivo que el principal u otro ya
+    //agregado, para no cargarlos ni guardarlos dos veces:
+    for (size_t i=0; i<fragmentos.size(); ++i){
+        bool repetido = false;
+        for (size_t j=0; j<this->archivos.size() && !repetido; ++j)
+            repetido = filesystem::equivalent(fragmentos[i], this->archivos[j], ec);
+        if (!repetido)
+            this->archivos.push_back(fragmentos[i]);
+    }
+    cargar_datos();
+    filtro_reconstruir();
 }
 
 bool jjConfig::cargar_datos()
 {
-    ifstream entrada(this->file.c_str());
+    size_t n = this->archivos.size();
+    vector<map<string, string> > leidos(n);
+    vector<char> correctos(n, 0);
+
+    //parsear los archivos en paralelo, el hilo actual también trabaja:
+    atomic<size_t> siguiente(0);
+    auto trabajar = [&](){
+        size_t i;
+        while ((i = siguiente.fetch_add(1)) < n)
+            correctos[i] = leer_archivo(this->archivos[i], leidos[i]);
+    };
+    size_t hilos = min<size_t>(n, max(1u, thread::hardware_concurrency()));
+    vector<thread> trabajadores;
+    trabajadores.reserve(hilos);
+    try {
+        for (size_t h=1; h<hilos; ++h)
+            trabajadores.push_back(thread(trabajar));
+    }
+    catch (const system_error &){
+        //no se pudieron crear más hilos: los que ya arrancaron y el actual
+        //se reparten los archivos que falten
+    }
+    trabajar();
+    for (size_t h=0; h<trabajadores.size(); ++h)
+        trabajadores[h].join();
+
+    //los archivos que existen pero no se pudieron leer no se sobrescriben:
+    this->ilegibles.assign(n, 0);
+    this->modificados.resize(n, 0);
+    for (size_t i=0; i<n; ++i){
+        error_code ec;
+        this->ilegibles[i] = !correctos[i] && filesystem::exists(this->archivos[i], ec);
+    }
+
+    //combinar en orden, el último archivo gana y el valor pisado queda
+    //guardado para volver a escribirlo en su archivo:
+    map<string, pair<string, size_t> > fusion;
+    map<string, pair<string, size_t> >::iterator f;
+    this->ocultas.assign(n, map<string, string>());
+    for (size_t i=0; i<n; ++i){
+        map<string, string>::iterator it = leidos[i].begin();
+        while (it != leidos[i].end()){
+            f = fusion.find(it->first);
+            if (f == fusion.end())
+                fusion.insert(make_pair(it->first, make_pair(it->second, i)));
+            else {
+                this->ocultas[f->second.second][it->first] = f->second.first;
+                f->second = make_pair(it->second, i);
+            }
+            it++;
+        }
+    }
+    for (f = fusion.begin(); f != fusion.end(); f++){
+        //los cambios sin guardar tienen prioridad sobre el disco:
+        map<string, Entrada>::iterator it = this->data.find(f->first);
+        if (it != this->data.end() && it->second.modificada)
+            continue;
+        //si el archivo dueño no se pudo leer se conserva el valor anterior,
+        //salvo que ahora lo pise un archivo posterior:
+        if (it != this->data.end() && it->second.presente &&
+                !correctos[it->second.origen] && f->second.second < it->second.origen){
+            this->ocultas[f->second.second][f->first] = f->second.first;
+            continue;
+        }
+        asignar(f->first, f->second.first);
+        Entrada &e = this->data[f->first];
+        e.origen = f->second.second;
+        e.en_disco = true;
+    }
+    //las opciones que estaban en un archivo leído y ya no están, se borran:
+    map<string, Entrada>::iterator it = this->data.begin();
+    while (it != this->data.end()){
+        Entrada &e = it->second;
+        if (e.presente && e.en_disco && !e.modificada && correctos[e.origen] &&
+                fusion.find(it->first) == fusion.end()){
+            e.presente = false;
+            e.en_disco = false;
+            avanzar_version(e);
+        }
+        it++;
+    }
+    return !this->directorio_incompleto &&
+        find(correctos.begin(), correctos.end(), 0) == correctos.end();
+}
+
+bool jjConfig::leer_archivo(const string &Ruta, map<string, string> &Datos)
+{
+    ifstream entrada(Ruta.c_str());
     if (!entrada.good())
         return false;
     string linea, clave, valor;
@@ -44,35 +190,104 @@ bool jjConfig::cargar_datos()
             valor = linea.substr(posigual+1);
             trim(clave);
             trim(valor);
-            this->data.insert(make_pair(clave, valor));
+            Datos.insert(make_pair(clave, valor));
         }
     }
+    bool correcto = !entrada.bad();
     entrada.close();
+    return correcto;
+}
+
+bool jjConfig::asignar(const string &Clave, const string &Val)
+{
+    size_t cantidad = this->data.size();
+    Entrada &e = this->data[Clave];
+    if (this->data.size() != cantidad)
+        filtro_agregar(Clave);
+    else if (e.presente && e.valor == Val)
+        return false;
+    e.valor = Val;
+    e.presente = true;
+    avanzar_version(e);
     return true;
 }
 
+void jjConfig::avanzar_version(Entrada &E)
+{
+    unsigned long g = this->generacion.valor.fetch_add(1, memory_order_acq_rel) + 1;
+    E.version.valor.store(g, memory_order_release);
+}
+
+jjConfig::Entrada* jjConfig::buscar(const string &Clave)
+{
+    if (!puede_existir(Clave))
+        return NULL;
+    map<string, Entrada>::iterator it;
+    it = this->data.find(Clave);
+    if (it == this->data.end() || !it->second.presente)
+        return NULL;
+    return &it->second;
+}
+
 bool jjConfig::Guardar()
 {
-    ofstream salida(this->file.c_str(), ios::trunc);
-    if (!salida.good())
-        return false;
-    map<string, string>::iterator it = this->data.begin();
+    //armar el contenido de cada archivo con las opciones de las que es dueño
+    //más las que fueron pisadas por otro archivo:
+    vector<map<string, string> > contenido(this->ocultas);
+    contenido.resize(this->archivos.size());
+    map<string, Entrada>::iterator it = this->data.begin();
     while (it != this->data.end()){
-        salida<<it->first<<"="<<it->second<<'\n';
+        if (it->second.presente)
+            contenido[it->second.origen][it->first] = it->second.valor;
         it++;
     }
-    salida.close();
-    return true;
+    bool correcto = true;
+    vector<char> escritos(this->archivos.size(), 0);
+    for (size_t i=0; i<this->archivos.size(); ++i){
+        //sólo se escriben los archivos con cambios, y el principal si todavía
+        //no existe:
+        error_code ec;
+        if (!this->modificados[i] && (i != 0 || filesystem::exists(this->archivos[i], ec)))
+            continue;
+        if (this->ilegibles[i]){
+            correcto = false;
+            continue;
+        }
+        ofstream salida(this->archivos[i].c_str(), ios::trunc);
+        if (!salida.good()){
+            correcto = false;
+            continue;
+        }
+        map<string, string>::iterator c = contenido[i].begin();
+        while (c != contenido[i].end()){
+            salida<<c->first<<"="<<c->second<<'\n';
+            c++;
+        }
+        salida.close();
+        escritos[i] = 1;
+        this->modificados[i] = 0;
+    }
+    for (it = this->data.begin(); it != this->data.end(); it++){
+        if (it->second.presente && escritos[it->second.origen]){
+            it->second.en_disco = true;
+            it->second.modificada = false;
+        }
+    }
+    return correcto;
 }
 
 void jjConfig::SetValor(const string &Clave, const string &Val)
 {
-    this->data[Clave] = Val;
+    if (asignar(Clave, Val)){
+        Entrada &e = this->data[Clave];
+        e.modificada = true;
+        this->modificados[e.origen] = 1;
+    }
 }
 
 void jjConfig::SetValor(const std::string &Clave, const char *Val)
 {
-    this->data[Clave] = Val;
+    SetValor(Clave, string(Val));
 }
 
 void jjConfig::SetValor(const string &Clave, int Val)
@@ -100,52 +315,158 @@ void jjConfig::SetValor(const string &Clave, bool Val)
 
 string jjConfig::Valor(const string &Clave, const string &Default)
 {
-    map<string, string>::iterator it;
-    it = this->data.find(Clave);
-    if (it == this->data.end())
+    Entrada *e = buscar(Clave);
+    if (e == NULL)
         return Default;
-    return it->second;
+    return e->valor;
 }
 
 int jjConfig::ValorInt(const string &Clave, int Default)
 {
-    map<string, string>::iterator it;
-    it = this->data.find(Clave);
-    if (it == this->data.end())
+    Entrada *e = buscar(Clave);
+    if (e == NULL)
         return Default;
-    return str2int(it->second);
+    return str2int(e->valor);
 }
 
 unsigned int jjConfig::ValorUInt(const string &Clave, unsigned int Default)
 {
-    map<string, string>::iterator it;
-    it = this->data.find(Clave);
-    if (it == this->data.end())
+    Entrada *e = buscar(Clave);
+    if (e == NULL)
         return Default;
-    return str2uint(it->second);
+    return str2uint(e->valor);
 }
 
 double jjConfig::ValorDouble(const string &Clave, double Default)
 {
-    map<string, string>::iterator it;
-    it = this->data.find(Clave);
-    if (it == this->data.end())
+    Entrada *e = buscar(Clave);
+    if (e == NULL)
         return Default;
-    return str2dbl(it->second);
+    return str2dbl(e->valor);
 }
 
 bool jjConfig::ValorBool(const string &Clave, bool Default)
 {
-    map<string, string>::iterator it;
-    it = this->data.find(Clave);
-    if (it == this->data.end())
+    Entrada *e = buscar(Clave);
+    if (e == NULL)
         return Default;
-    return str2bool(it->second);
+    return str2bool(e->valor);
 }
 
 bool jjConfig::Existe(const std::string &Clave)
 {
-    return this->data.find(Clave) != this->data.end();
+    return buscar(Clave) != NULL;
+}
+
+string jjConfig::Origen(const string &Clave)
+{
+    Entrada *e = buscar(Clave);
+    if (e == NULL)
+        return "";
+    return this->archivos[e->origen];
+}
+
+bool jjConfig::Recargar()
+{
+    return cargar_datos();
+}
+
+unsigned long jjConfig::Generacion()
+{
+    return this->generacion.valor.load(memory_order_acquire);
+}
+
+unsigned long jjConfig::Version(const string &Clave)
+{
+    if (!puede_existir(Clave))
+        return 0;
+    map<string, Entrada>::iterator it;
+    it = this->data.find(Clave);
+    if (it == this->data.end())
+        return 0;
+    return it->second.version.valor.load(memory_order_acquire);
+}
+
+jjConfig::Referencia jjConfig::Referenciar(const string &Clave)
+{
+    if (!puede_existir(Clave))
+        return Referencia(&this->generacion.valor);
+    map<string, Entrada>::iterator it;
+    it = this->data.find(Clave);
+    if (it == this->data.end())
+        return Referencia(&this->generacion.valor);
+    return Referencia(&it->second.version.valor);
+}
+
+
+/****************************************************************************
+ * FILTRO DE BLOOM (PRIVADAS):
+ ***************************************************************************/
+
+/* cantidad de claves a partir de la cual se usa el filtro: con menos, buscar
+ * en el mapa cuesta lo mismo que calcular el hash y el filtro sólo agrega
+ * tiempo a las búsquedas de claves existentes (ver test/bench.cpp) */
+static const size_t umbral_filtro = 1024;
+
+/* bits que ocupa una clave dentro de su palabra del filtro: 3 posiciones
+ * tomadas de una segunda mezcla del hash */
+static unsigned int mascara_filtro(unsigned int Hash)
+{
+    unsigned int m = Hash * 0x9E3779B1u;
+    return (1u << (m >> 27)) | (1u << ((m >> 22) & 31)) |
+        (1u << ((m >> 17) & 31));
+}
+
+unsigned int jjConfig::hash_clave(const string &Clave)
+{
+    unsigned int h = 2166136261u;
+    for (size_t i=0; i<Clave.size(); ++i){
+        h ^= (unsigned char)Clave[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void jjConfig::filtro_agregar(const string &Clave)
+{
+    //si el filtro quedó chico para las claves del mapa (o recién se llegó al
+    //umbral) se rearma entero:
+    if (this->filtro.empty() || this->filtro.size() * 2 < this->data.size()){
+        if (this->data.size() < umbral_filtro)
+            return;
+        filtro_reconstruir();
+        return;
+    }
+    unsigned int h = hash_clave(Clave);
+    this->filtro[h & (this->filtro.size() - 1)] |= mascara_filtro(h);
+}
+
+void jjConfig::filtro_reconstruir()
+{
+    if (this->data.size() < umbral_filtro){
+        this->filtro.clear();
+        return;
+    }
+    //una palabra de 32 bits cada 2 claves, en potencia de 2:
+    size_t palabras = 16;
+    while (palabras * 2 < this->data.size())
+        palabras *= 2;
+    this->filtro.assign(palabras, 0);
+    map<string, Entrada>::iterator it = this->data.begin();
+    while (it != this->data.end()){
+        unsigned int h = hash_clave(it->first);
+        this->filtro[h & (palabras - 1)] |= mascara_filtro(h);
+        it++;
+    }
+}
+
+bool jjConfig::puede_existir(const string &Clave)
+{
+    if (this->filtro.empty())
+        return true;
+    unsigned int h = hash_clave(Clave);
+    unsigned int m = mascara_filtro(h);
+    return (this->filtro[h & (this->filtro.size() - 1)] & m) == m;
 }
 
 
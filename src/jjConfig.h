@@ -59,8 +59,10 @@
 #ifndef _JJCONFIG_H_
 #define _JJCONFIG_H_
 
+#include <atomic>
 #include <map>
 #include <string>
+#include <vector>
 
 
 /// Clase principal.
@@ -68,22 +70,167 @@
  * Para usar la librería hay que crear un objeto de tipo jjConfig y luego
  * trabajar con sus métodos públicos. Al instanciar el objeto se cargan las
  * opciones de configuración a memoria leídas de un archivo.
+ *
+ * Los objetos se pueden copiar: la copia arranca con los mismos valores y
+ * versiones pero con contadores propios, así que las Referencia obtenidas
+ * del original siguen observando al original. Mover un objeto es lo mismo
+ * que copiarlo. Asignar sobre un objeto invalida las Referencia que se hayan
+ * obtenido de él.
  */
 class jjConfig {
 private:
-    std::map<std::string, std::string> data; ///< Mapa que guarda los datos
-    std::string file; ///< Indica la ruta del archivo de configuración en disco
+    ///Contador atómico copiable.
+    /**
+     * \c std::atomic no se puede copiar; este envoltorio copia el valor
+     * actual en un contador nuevo para que jjConfig siga siendo copiable.
+     */
+    struct Contador {
+        std::atomic<unsigned long> valor; ///< Valor del contador
+
+        Contador() : valor(0) {}
+        Contador(const Contador &Otro) : valor(Otro.valor.load()) {}
+        Contador& operator=(const Contador &Otro)
+        {
+            this->valor.store(Otro.valor.load());
+            return *this;
+        }
+    };
+
+    ///Entrada del mapa de datos.
+    /**
+     * Guarda el valor de una opción junto con su número de versión, que se
+     * actualiza cada vez que el valor cambia. Las opciones borradas del disco
+     * no se quitan del mapa (para no invalidar las Referencia) sino que quedan
+     * marcadas como ausentes.
+     */
+    struct Entrada {
+        std::string valor; ///< Valor de la opción
+        Contador version; ///< Versión del valor
+        size_t origen; ///< Índice en \c archivos del archivo dueño de la opción
+        bool presente; ///< \c false si la opción fue borrada del disco
+        bool en_disco; ///< \c true si la opción fue leída o guardada en su archivo
+        bool modificada; ///< \c true si SetValor() la cambió y todavía no se guardó
+
+        Entrada() : origen(0), presente(true), en_disco(false), modificada(false) {}
+    };
+
+    std::map<std::string, Entrada> data; ///< Mapa que guarda los datos
+    Contador generacion; ///< Cantidad de cambios hechos a los datos
+    std::vector<std::string> archivos; ///< Rutas de los archivos de configuración en disco (el principal primero)
+    std::vector<std::map<std::string, std::string> > ocultas; ///< Opciones de cada archivo pisadas por un archivo posterior
+    std::vector<char> modificados; ///< Archivos con opciones cambiadas por SetValor() sin guardar
+    std::vector<char> ilegibles; ///< Archivos que existen pero no se pudieron leer
+    bool directorio_incompleto; ///< \c true si no se pudo listar entero el directorio de fragmentos
+    std::vector<unsigned int> filtro; ///< Filtro de Bloom de las claves presentes
+
 
     ///Carga los datos del archivo de configuración.
     /**
-     * Esta función carga todos los datos que se encuentren en el archivo de
+     * Esta función carga todos los datos que se encuentren en los archivos de
      * configuración con que fue instanciada la clase y los deja disponible
      * en memoria. Si el archivo no existe, la función lo creará.
+     * Los archivos se leen en paralelo y luego se combinan en orden: si una
+     * opción aparece en más de un archivo, gana el último. Cada opción queda
+     * asociada al archivo del que se tomó su valor.
+     * Al recargar, las opciones de un archivo que no se pudo leer conservan
+     * su valor y su archivo dueño.
      * 
      * \return \c true si no hubo ningún error, \c false en caso contrario.
      */
     bool cargar_datos();
-    
+
+
+    ///Lee un archivo de configuración.
+    /**
+     * Parsea las líneas <tt>clave=valor</tt> de un archivo. Si una clave
+     * aparece más de una vez, se queda con la primera. No modifica el estado
+     * del objeto, por lo que puede llamarse desde varios hilos a la vez.
+     *
+     * \param Ruta Ruta del archivo a leer.
+     * \param Datos Mapa donde se dejan las opciones leídas.
+     * \return \c true si no hubo ningún error, \c false en caso contrario.
+     */
+    bool leer_archivo(const std::string &Ruta, std::map<std::string, std::string> &Datos);
+
+
+    ///Asigna el valor de una opción.
+    /**
+     * Agrega o actualiza una opción en el mapa. Si el valor cambia, avanza la
+     * generación global y la versión de la entrada toma ese nuevo número; si
+     * el valor es el mismo que ya tenía no hace nada.
+     *
+     * \param Clave Nombre de la opción.
+     * \param Val Valor a guardar.
+     * \return \c true si el valor cambió, \c false en caso contrario.
+     */
+    bool asignar(const std::string &Clave, const std::string &Val);
+
+
+    ///Avanza la versión de una entrada.
+    /**
+     * Avanza la generación global y le asigna el nuevo número a la versión
+     * de la entrada.
+     *
+     * \param E Entrada que cambió.
+     */
+    void avanzar_version(Entrada &E);
+
+
+    ///Busca una opción presente.
+    /**
+     * \param Clave Nombre de la opción.
+     * \return La entrada de la opción, o \c NULL si no existe o fue borrada.
+     */
+    Entrada* buscar(const std::string &Clave);
+
+
+    /* filtro de Bloom para las búsquedas de claves inexistentes: */
+
+    ///Hash de una clave.
+    /**
+     * Calcula el hash FNV-1a de 32 bits de una clave, usado por el filtro de
+     * Bloom.
+     *
+     * \param Clave Clave a la que se le calcula el hash.
+     * \return El hash de la clave.
+     */
+    unsigned int hash_clave(const std::string &Clave);
+
+
+    ///Agrega una clave al filtro.
+    /**
+     * Marca una clave como presente en el filtro de Bloom. Si el filtro queda
+     * demasiado cargado para la cantidad de claves del mapa, lo reconstruye
+     * con el doble de tamaño; si está vacío, lo arma recién cuando el mapa
+     * llega a la cantidad de claves a partir de la cual conviene usarlo.
+     *
+     * \param Clave Clave a agregar.
+     */
+    void filtro_agregar(const std::string &Clave);
+
+
+    ///Reconstruye el filtro.
+    /**
+     * Vuelve a armar el filtro de Bloom a partir de todas las claves del
+     * mapa, dimensionándolo según la cantidad de claves (unos 16 bits por
+     * clave). Con pocas claves el filtro no se usa y queda vacío.
+     */
+    void filtro_reconstruir();
+
+
+    ///Consulta el filtro.
+    /**
+     * Cada clave ocupa una sola palabra de 32 bits del filtro, por lo que la
+     * consulta toca una única línea de caché. Puede dar falsos positivos pero
+     * nunca falsos negativos: si devuelve \c false la clave seguro no está en
+     * el mapa y no hace falta buscarla.
+     * Si el filtro está vacío (pocas claves) siempre devuelve \c true.
+     *
+     * \param Clave Clave a consultar.
+     * \return \c false si la clave seguro no existe, \c true si puede existir.
+     */
+    bool puede_existir(const std::string &Clave);
+
     /* funciones de utilería: */
     
     ///Quita espacios de sobra a una cadena.
@@ -175,6 +322,49 @@ private:
     
 public:
 
+    ///Referencia a la versión de una opción.
+    /**
+     * Permite a quien guarda en caché valores leídos de la configuración
+     * saber si cambiaron, leyendo un único contador atómico y sin volver a
+     * buscar la clave en el mapa. Se obtiene con jjConfig::Referenciar() y
+     * es válida mientras viva el objeto jjConfig del que salió.
+     * \code
+     *      jjConfig::Referencia ref = opciones.Referenciar("ancho");
+     *      unsigned long version = ref.Version();
+     *      int ancho = opciones.ValorInt("ancho", 640);
+     *      //...más tarde:
+     *      if (ref.Version() != version){
+     *          //el valor cambió, volver a leerlo
+     *      }
+     * \endcode
+     */
+    class Referencia {
+    private:
+        friend class jjConfig;
+
+        const std::atomic<unsigned long> *version; ///< Contador observado
+
+        ///Constructor.
+        /**
+         * Sólo jjConfig crea referencias, a través de jjConfig::Referenciar().
+         *
+         * \param Version Contador de versión a observar.
+         */
+        explicit Referencia(const std::atomic<unsigned long> *Version) : version(Version) {}
+
+    public:
+
+        ///Versión actual.
+        /**
+         * \return El número de versión actual de la opción referenciada.
+         */
+        unsigned long Version() const
+        {
+            return this->version->load(std::memory_order_acquire);
+        }
+    };
+
+
     ///Constructor.
     /**
      * Constructor de la clase. Recibe como parámetro la ruta en disco del
@@ -187,6 +377,70 @@ public:
      */
     jjConfig(const std::string &Archivo);
 
+
+    ///Constructor con directorio de fragmentos.
+    /**
+     * Además del archivo principal, carga los archivos regulares que haya en
+     * un directorio (al estilo <tt>conf.d/</tt>). Se ignoran los archivos
+     * ocultos (que empiezan con <tt>.</tt>), los temporales de editores
+     * (que empiezan con <tt>#</tt> o terminan en <tt>~</tt>, <tt>.swp</tt>,
+     * <tt>.swo</tt>, <tt>.bak</tt>, <tt>.orig</tt>, <tt>.rej</tt> o
+     * <tt>.tmp</tt>) y los que dejan los gestores de paquetes
+     * (<tt>.dpkg-*</tt>, <tt>.rpmnew</tt>, <tt>.rpmsave</tt>,
+     * <tt>.rpmorig</tt>, <tt>.ucf-*</tt>). Los fragmentos se
+     * parsean en paralelo y se combinan en orden lexicográfico de nombre,
+     * después del archivo principal: si una opción aparece en más de un
+     * archivo, gana el último. El conjunto de fragmentos se fija al construir
+     * el objeto. Si el archivo principal está dentro del directorio, o algún
+     * fragmento es el mismo archivo que otro (por ejemplo, un enlace), se
+     * carga una sola vez.
+     *
+     * Cada opción recuerda de qué archivo salió su valor, y Guardar() la
+     * escribe de vuelta en ese archivo. Las opciones nuevas van al archivo
+     * principal.
+     *
+     * \param Archivo Ruta del archivo de configuración principal.
+     * Si el directorio existe pero no se pudo recorrer entero, se cargan los
+     * fragmentos que se alcanzaron a listar y Recargar() devuelve siempre
+     * \c false.
+     *
+     * \param Directorio Ruta del directorio de fragmentos. Si no existe, se
+     * comporta igual que el otro constructor.
+     */
+    jjConfig(const std::string &Archivo, const std::string &Directorio);
+
+
+    ///Constructor de copia.
+    jjConfig(const jjConfig &Otro) = default;
+
+
+    ///Constructor de movimiento.
+    /**
+     * Copia el objeto en lugar de moverlo, para que las Referencia obtenidas
+     * del original (incluidas las de opciones inexistentes, que observan la
+     * generación) sigan todas observando al original.
+     *
+     * \param Otro Objeto a copiar.
+     */
+    jjConfig(jjConfig &&Otro) : jjConfig(static_cast<const jjConfig&>(Otro)) {}
+
+
+    ///Asignación por copia.
+    jjConfig& operator=(const jjConfig &Otro) = default;
+
+
+    ///Asignación por movimiento.
+    /**
+     * Igual que el constructor de movimiento, copia en lugar de mover.
+     *
+     * \param Otro Objeto a copiar.
+     * \return Este objeto.
+     */
+    jjConfig& operator=(jjConfig &&Otro)
+    {
+        return *this = static_cast<const jjConfig&>(Otro);
+    }
+
     
     ///Guarda todos los datos a disco.
     /**
@@ -195,6 +449,10 @@ public:
      * instanciada la clase. Si desea hacerse permanentes todas las opciones
      * configuradas con la clase, debe llamarse a esta función manualmente para
      * persistir los datos, en ningún momento se lo hace automáticamente.
+     * Si se usa un directorio de fragmentos, cada opción se guarda en el
+     * archivo del que fue leída. Sólo se escriben los archivos en los que
+     * cambió alguna opción (y el principal si todavía no existe); los que
+     * existen pero no pudieron leerse nunca se sobrescriben.
      * 
      * \return \c true si no hubo ningún error, \c false en caso contrario.
      */
@@ -342,6 +600,70 @@ public:
      * \return \c si la opción existe, \c false en caso contrario.
      */
     bool Existe(const std::string &Clave);
+
+
+    ///Saber de qué archivo es una opción.
+    /**
+     * Devuelve la ruta del archivo en el que Guardar() escribirá la opción:
+     * el archivo del que se leyó su valor, o el archivo principal si la
+     * opción se creó con SetValor().
+     *
+     * \param Clave Nombre de la opción.
+     * \return La ruta del archivo, o una cadena vacía si la opción no existe.
+     */
+    std::string Origen(const std::string &Clave);
+
+
+    /* versiones: */
+
+    ///Vuelve a leer el archivo de configuración.
+    /**
+     * Lee nuevamente los archivos de configuración y actualiza en memoria las
+     * opciones que cambiaron en disco, avanzando sus versiones. Las opciones
+     * que fueron borradas del disco dejan de existir (y también avanza su
+     * versión). Las opciones creadas o cambiadas con SetValor() que todavía
+     * no se guardaron conservan el valor que tienen en memoria, igual que las
+     * de un archivo que no se pudo volver a leer.
+     *
+     * \return \c true si no hubo ningún error, \c false en caso contrario
+     * (incluso si el directorio de fragmentos no se pudo listar entero).
+     */
+    bool Recargar();
+
+
+    ///Generación actual.
+    /**
+     * La generación es un contador global que avanza cada vez que cambia el
+     * valor de alguna opción, ya sea por SetValor() o por Recargar(). Si no
+     * cambió desde la última vez que se consultó, ninguna opción cambió.
+     *
+     * \return La generación actual de los datos.
+     */
+    unsigned long Generacion();
+
+
+    ///Versión de una opción.
+    /**
+     * Cada opción guarda el número de generación en que cambió su valor por
+     * última vez.
+     *
+     * \param Clave Nombre de la opción.
+     * \return La versión de la opción, o \c 0 si nunca existió.
+     */
+    unsigned long Version(const std::string &Clave);
+
+
+    ///Obtener una referencia a la versión de una opción.
+    /**
+     * Devuelve una Referencia con la que consultar la versión de la opción
+     * sin volver a buscarla. Si la opción todavía no existe, la referencia
+     * observa la generación global, de modo que cualquier cambio la hace
+     * avanzar.
+     *
+     * \param Clave Nombre de la opción.
+     * \return La referencia a la versión de la opción.
+     */
+    Referencia Referenciar(const std::string &Clave);
 };
 
 #endif
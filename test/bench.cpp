@@ -0,0 +1,45 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "../lib/jjconfig.h"
+
+using namespace std;
+
+//mide el tiempo promedio por búsqueda con ValorInt sobre un conjunto de
+//claves, repitiendo hasta completar unas 2 millones de búsquedas:
+static double medir(jjConfig &config, const vector<string> &claves)
+{
+    size_t vueltas = 2000000 / claves.size() + 1;
+    long suma = 0;
+    chrono::steady_clock::time_point inicio = chrono::steady_clock::now();
+    for (size_t v=0; v<vueltas; ++v){
+        for (size_t i=0; i<claves.size(); ++i)
+            suma += config.ValorInt(claves[i], 1);
+    }
+    chrono::duration<double, nano> total = chrono::steady_clock::now() - inicio;
+    if (suma == 42)
+        printf(" ");
+    return total.count() / (vueltas * claves.size());
+}
+
+int main()
+{
+    const size_t tamanios[] = {10, 30, 100, 300, 1000, 3000, 10000};
+    char clave[64];
+    printf("%8s %12s %12s\n", "claves", "hit (ns)", "miss (ns)");
+    for (size_t t=0; t<sizeof(tamanios)/sizeof(tamanios[0]); ++t){
+        jjConfig config("archivo_que_no_existe");
+        vector<string> presentes, ausentes;
+        for (size_t i=0; i<tamanios[t]; ++i){
+            sprintf(clave, "servidor.opcion_%06zu", i);
+            config.SetValor(clave, (int)i);
+            presentes.push_back(clave);
+            sprintf(clave, "servidor.opcion_%06zu_x", i);
+            ausentes.push_back(clave);
+        }
+        printf("%8zu %12.1f %12.1f\n", tamanios[t], medir(config, presentes),
+            medir(config, ausentes));
+    }
+    return 0;
+}
@@ -1,6 +1,9 @@
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <unistd.h>
 #include <gtest/gtest.h>
 #include "../lib/jjconfig.h"
 
@@ -145,6 +148,335 @@ TEST_F(jjConfigTest, test_existe) {
     ASSERT_TRUE(b4);
 }
 
+TEST_F(jjConfigTest, test_existe_muchas_claves) {
+    //pasa el umbral a partir del cual se usa el filtro de claves y fuerza
+    //varias reconstrucciones; sólo verifica que los resultados sigan siendo
+    //correctos (el descarte de claves inexistentes se mide con make bench):
+    jjConfig config("archivo_que_no_existe");
+    char clave[32];
+    for (int i=0; i<5000; ++i){
+        sprintf(clave, "clave%d", i);
+        config.SetValor(clave, i);
+    }
+    for (int i=0; i<5000; ++i){
+        sprintf(clave, "clave%d", i);
+        ASSERT_TRUE(config.Existe(clave));
+        ASSERT_EQ(config.ValorInt(clave, -1), i);
+    }
+    for (int i=5000; i<10000; ++i){
+        sprintf(clave, "clave%d", i);
+        ASSERT_FALSE(config.Existe(clave));
+        ASSERT_EQ(config.ValorInt(clave, -1), -1);
+    }
+}
+
+TEST_F(jjConfigTest, test_versiones) {
+    ofstream archivo("testversiones", ios::trunc);
+    archivo<<"ancho=640"<<endl;
+    archivo<<"alto=480"<<endl;
+    archivo.close();
+
+    jjConfig config("testversiones");
+    jjConfig::Referencia ancho = config.Referenciar("ancho");
+    jjConfig::Referencia alto = config.Referenciar("alto");
+    jjConfig::Referencia nueva = config.Referenciar("nueva");
+    unsigned long g = config.Generacion();
+    unsigned long vancho = ancho.Version();
+    unsigned long valto = alto.Version();
+    unsigned long vnueva = nueva.Version();
+    ASSERT_EQ(config.Version("ancho"), vancho);
+    ASSERT_EQ(config.Version("nueva"), 0u);
+
+    //asignar el mismo valor no cambia nada:
+    config.SetValor("ancho", 640);
+    ASSERT_EQ(config.Generacion(), g);
+    ASSERT_EQ(ancho.Version(), vancho);
+
+    config.SetValor("ancho", 800);
+    ASSERT_NE(config.Generacion(), g);
+    ASSERT_NE(ancho.Version(), vancho);
+    ASSERT_EQ(alto.Version(), valto);
+    //una referencia a una opción inexistente avanza con cualquier cambio:
+    ASSERT_NE(nueva.Version(), vnueva);
+
+    //recargar sólo avanza las opciones que cambiaron en disco:
+    archivo.open("testversiones", ios::trunc);
+    archivo<<"ancho=800"<<endl;
+    archivo<<"alto=600"<<endl;
+    archivo.close();
+    vancho = ancho.Version();
+    ASSERT_TRUE(config.Recargar());
+    ASSERT_EQ(ancho.Version(), vancho);
+    ASSERT_NE(alto.Version(), valto);
+    ASSERT_EQ(config.ValorInt("alto", 0), 600);
+
+    remove("testversiones");
+}
+
+TEST_F(jjConfigTest, test_recargar_borrada) {
+    ofstream archivo("testborrada", ios::trunc);
+    archivo<<"ancho=640"<<endl;
+    archivo<<"alto=480"<<endl;
+    archivo.close();
+
+    jjConfig config("testborrada");
+    config.SetValor("sin_guardar", 1);
+    //un cambio sin guardar sobrevive a la recarga, como las opciones nuevas:
+    config.SetValor("ancho", 800);
+    ASSERT_TRUE(config.Recargar());
+    ASSERT_EQ(config.ValorInt("ancho", 0), 800);
+    jjConfig::Referencia alto = config.Referenciar("alto");
+    unsigned long valto = alto.Version();
+    unsigned long g = config.Generacion();
+
+    //borrar "alto" del disco y recargar:
+    archivo.open("testborrada", ios::trunc);
+    archivo<<"ancho=640"<<endl;
+    archivo.close();
+    ASSERT_TRUE(config.Recargar());
+    ASSERT_NE(config.Generacion(), g);
+    ASSERT_NE(alto.Version(), valto);
+    ASSERT_FALSE(config.Existe("alto"));
+    ASSERT_EQ(config.ValorInt("alto", -1), -1);
+    //las opciones que todavía no se guardaron se conservan:
+    ASSERT_EQ(config.ValorInt("sin_guardar", 0), 1);
+
+    //guardar no vuelve a escribir la opción borrada:
+    ASSERT_TRUE(config.Guardar());
+    jjConfig guardada("testborrada");
+    ASSERT_FALSE(guardada.Existe("alto"));
+    ASSERT_EQ(guardada.ValorInt("ancho", 0), 800);
+    ASSERT_EQ(guardada.ValorInt("sin_guardar", 0), 1);
+
+    //volver a asignarla la recupera y avanza la versión:
+    valto = alto.Version();
+    config.SetValor("alto", 480);
+    ASSERT_TRUE(config.Existe("alto"));
+    ASSERT_NE(alto.Version(), valto);
+
+    remove("testborrada");
+}
+
+TEST_F(jjConfigTest, test_copia) {
+    jjConfig original("archivo_que_no_existe");
+    original.SetValor("ancho", 640);
+    jjConfig::Referencia ref = original.Referenciar("ancho");
+    unsigned long version = ref.Version();
+
+    jjConfig copia(original);
+    ASSERT_EQ(copia.ValorInt("ancho", 0), 640);
+    ASSERT_EQ(copia.Version("ancho"), version);
+    ASSERT_EQ(copia.Generacion(), original.Generacion());
+
+    //la copia tiene contadores propios:
+    copia.SetValor("ancho", 800);
+    ASSERT_EQ(ref.Version(), version);
+    ASSERT_EQ(original.ValorInt("ancho", 0), 640);
+
+    //mover es lo mismo que copiar, todas las referencias siguen al original:
+    jjConfig::Referencia nueva = original.Referenciar("nueva");
+    unsigned long vnueva = nueva.Version();
+    jjConfig movida(std::move(original));
+    movida.SetValor("ancho", 1024);
+    movida.SetValor("nueva", 1);
+    ASSERT_EQ(ref.Version(), version);
+    ASSERT_EQ(nueva.Version(), vnueva);
+    ASSERT_EQ(movida.ValorInt("ancho", 0), 1024);
+
+    vector<jjConfig> varios;
+    varios.push_back(copia);
+    ASSERT_EQ(varios[0].ValorInt("ancho", 0), 800);
+}
+
+TEST_F(jjConfigTest, test_directorio_fragmentos) {
+    filesystem::create_directory("testconf.d");
+    ofstream archivo("testbase", ios::trunc);
+    archivo<<"nombre=base"<<endl;
+    archivo<<"puerto=80"<<endl;
+    archivo.close();
+    archivo.open("testconf.d/20-local", ios::trunc);
+    archivo<<"puerto=8080"<<endl;
+    archivo.close();
+    archivo.open("testconf.d/10-red", ios::trunc);
+    archivo<<"puerto=443"<<endl;
+    archivo<<"host=localhost"<<endl;
+    archivo.close();
+    //archivos que no son fragmentos:
+    archivo.open("testconf.d/.10-red.swp", ios::trunc);
+    archivo<<"puerto=1"<<endl;
+    archivo.close();
+    archivo.open("testconf.d/30-viejo~", ios::trunc);
+    archivo<<"puerto=2"<<endl;
+    archivo.close();
+    archivo.open("testconf.d/40-paquete.dpkg-old", ios::trunc);
+    archivo<<"puerto=3"<<endl;
+    archivo.close();
+
+    {
+        jjConfig config("testbase", "testconf.d");
+        //los fragmentos se aplican en orden lexicográfico, el último gana:
+        ASSERT_EQ(config.ValorInt("puerto", 0), 8080);
+        ASSERT_EQ(config.Valor("host", ""), "localhost");
+        ASSERT_EQ(config.Valor("nombre", ""), "base");
+        ASSERT_EQ(config.Origen("puerto"), "testconf.d/20-local");
+        ASSERT_EQ(config.Origen("host"), "testconf.d/10-red");
+        ASSERT_EQ(config.Origen("nombre"), "testbase");
+        ASSERT_EQ(config.Origen("valor_que_no_existe"), "");
+
+        config.SetValor("host", "ejemplo.com");
+        config.SetValor("nueva", 1);
+        ASSERT_EQ(config.Origen("nueva"), "testbase");
+        ASSERT_TRUE(config.Guardar());
+    }
+
+    //cada opción vuelve a su archivo y las pisadas se conservan:
+    jjConfig base("testbase");
+    ASSERT_EQ(base.ValorInt("puerto", 0), 80);
+    ASSERT_EQ(base.ValorInt("nueva", 0), 1);
+    ASSERT_FALSE(base.Existe("host"));
+    jjConfig red("testconf.d/10-red");
+    ASSERT_EQ(red.ValorInt("puerto", 0), 443);
+    ASSERT_EQ(red.Valor("host", ""), "ejemplo.com");
+    jjConfig local("testconf.d/20-local");
+    ASSERT_EQ(local.ValorInt("puerto", 0), 8080);
+    ASSERT_FALSE(local.Existe("nombre"));
+    jjConfig viejo("testconf.d/30-viejo~");
+    ASSERT_EQ(viejo.ValorInt("puerto", 0), 2);
+
+    remove("testbase");
+    filesystem::remove_all("testconf.d");
+}
+
+TEST_F(jjConfigTest, test_directorio_con_principal) {
+    //el archivo principal también aparece como fragmento del directorio:
+    filesystem::create_directory("testconf.d");
+    ofstream archivo("testconf.d/principal", ios::trunc);
+    archivo<<"nombre=base"<<endl;
+    archivo.close();
+
+    {
+        jjConfig config("testconf.d/principal", "testconf.d");
+        ASSERT_EQ(config.Valor("nombre", ""), "base");
+        config.SetValor("nueva", 5);
+        ASSERT_TRUE(config.Guardar());
+    }
+    {
+        jjConfig config("./testconf.d/principal", "testconf.d");
+        ASSERT_EQ(config.ValorInt("nueva", 0), 5);
+        ASSERT_EQ(config.Origen("nombre"), "./testconf.d/principal");
+    }
+
+    filesystem::remove_all("testconf.d");
+}
+
+TEST_F(jjConfigTest, test_guardar_sin_cambios) {
+    filesystem::create_directory("testconf.d");
+    ofstream archivo("testbase", ios::trunc);
+    archivo<<"nombre=base"<<endl;
+    archivo.close();
+    archivo.open("testconf.d/10-red", ios::trunc);
+    archivo<<"# comentario"<<endl;
+    archivo<<"puerto=443"<<endl;
+    archivo.close();
+
+    {
+        jjConfig config("testbase", "testconf.d");
+        config.SetValor("nombre", "otro");
+        ASSERT_EQ(config.Guardar(), true);
+    }
+
+    //el fragmento sin cambios no se reescribe (conserva el comentario):
+    ifstream red("testconf.d/10-red");
+    string linea;
+    getline(red, linea);
+    ASSERT_EQ(linea, "# comentario");
+    red.close();
+    jjConfig base("testbase");
+    ASSERT_EQ(base.Valor("nombre", ""), "otro");
+
+    remove("testbase");
+    filesystem::remove_all("testconf.d");
+}
+
+TEST_F(jjConfigTest, test_guardar_fragmento_sin_permisos) {
+    //con permisos de administrador los archivos se pueden leer igual (el
+    //caso del fragmento ilegible con cambios lo cubre
+    //test_recargar_fragmento_ilegible):
+    if (geteuid() == 0)
+        GTEST_SKIP();
+
+    filesystem::create_directory("testconf.d");
+    ofstream archivo("testbase", ios::trunc);
+    archivo<<"nombre=base"<<endl;
+    archivo.close();
+    archivo.open("testconf.d/20-privado", ios::trunc);
+    archivo<<"clave=secreta"<<endl;
+    archivo.close();
+    filesystem::permissions("testconf.d/20-privado", filesystem::perms::none);
+
+    {
+        jjConfig config("testbase", "testconf.d");
+        ASSERT_FALSE(config.Existe("clave"));
+        config.SetValor("nombre", "otro");
+        ASSERT_TRUE(config.Guardar());
+    }
+
+    //el fragmento que no se pudo leer no se vacía:
+    filesystem::permissions("testconf.d/20-privado", filesystem::perms::owner_all);
+    jjConfig privado("testconf.d/20-privado");
+    ASSERT_EQ(privado.Valor("clave", ""), "secreta");
+
+    remove("testbase");
+    filesystem::remove_all("testconf.d");
+}
+
+TEST_F(jjConfigTest, test_recargar_fragmento_ilegible) {
+    filesystem::create_directory("testconf.d");
+    ofstream archivo("testbase", ios::trunc);
+    archivo<<"k=base"<<endl;
+    archivo.close();
+    archivo.open("testconf.d/10", ios::trunc);
+    archivo<<"k=frag"<<endl;
+    archivo.close();
+
+    jjConfig config("testbase", "testconf.d");
+    ASSERT_EQ(config.Valor("k", ""), "frag");
+
+    //reemplazar el fragmento por un directorio: existe pero no se puede
+    //leer (ni siquiera con permisos de administrador):
+    filesystem::remove("testconf.d/10");
+    filesystem::create_directory("testconf.d/10");
+    ASSERT_FALSE(config.Recargar());
+    ASSERT_EQ(config.Valor("k", ""), "frag");
+    ASSERT_EQ(config.Origen("k"), "testconf.d/10");
+
+    //el cambio no va a parar al archivo principal:
+    config.SetValor("k", "nuevo");
+    ASSERT_FALSE(config.Guardar());
+    jjConfig base("testbase");
+    ASSERT_EQ(base.Valor("k", ""), "base");
+
+    remove("testbase");
+    filesystem::remove_all("testconf.d");
+}
+
+TEST_F(jjConfigTest, test_directorio_no_listable) {
+    ofstream archivo("testbase", ios::trunc);
+    archivo<<"k=base"<<endl;
+    archivo.close();
+
+    //un directorio inexistente no es un error:
+    jjConfig sin_directorio("testbase", "testconf.d");
+    ASSERT_TRUE(sin_directorio.Recargar());
+
+    //pero uno que no se puede recorrer sí (acá es un archivo común):
+    jjConfig config("testbase", "testbase");
+    ASSERT_EQ(config.Valor("k", ""), "base");
+    ASSERT_FALSE(config.Recargar());
+
+    remove("testbase");
+}
+
 int main(int argc, char **argv){
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();